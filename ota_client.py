@@ -0,0 +1,102 @@
+# Stand-in for the toy's OTA client, used to test firmware updates against a local server
+# without flashing a device. Follows the same protocol as ota_update() in src/main.cpp.
+
+# 1. Publish a firmware image (see step 8 in server.py) and launch the server locally:
+#    $ python3 -m flask run --host=0.0.0.0 --port=5000
+
+# 2. Pull the update, dropping the connection after 5 chunks to exercise resume:
+#    $ python3 ota_client.py --host http://127.0.0.1:5000 --interrupt-after 5
+#    $ python3 ota_client.py --host http://127.0.0.1:5000
+
+# 3. Compare against downloading the uncompressed image:
+#    $ python3 ota_client.py --host http://127.0.0.1:5000 --compare-full
+
+import argparse
+import hashlib
+import json
+import os
+import sys
+import time
+import zlib
+import requests
+
+parser = argparse.ArgumentParser(description='Simulated OTA update client')
+parser.add_argument('--host', default='http://127.0.0.1:5000')
+parser.add_argument('--current-version', type=int, default=1)
+parser.add_argument('--interrupt-after', type=int, default=None, help='Stop after N chunks to simulate a dropped link')
+parser.add_argument('--compare-full', action='store_true', help='Also time a download of the uncompressed image')
+parser.add_argument('--state', default='ota_client_state.json', help='Stands in for the device NVS progress keys')
+parser.add_argument('--out', default='ota_client_partition.bin', help='Stands in for the inactive OTA partition')
+args = parser.parse_args()
+
+# Check version endpoint
+manifest = requests.get(f"{args.host}/firmware/version").json()
+print(f"Server version: {manifest['version']}, running version: {args.current_version}")
+if manifest['version'] <= args.current_version:
+    print("Already up to date.")
+    sys.exit(0)
+
+# Resume only if the saved progress belongs to the same image
+state = {}
+if os.path.exists(args.state):
+    with open(args.state, 'r') as file:
+        state = json.load(file)
+if state.get('sha256') != manifest['sha256'] or not os.path.exists(args.out):
+    state = {'sha256': manifest['sha256'], 'next': 0}
+    with open(args.out, 'wb') as file:
+        file.truncate(manifest['size'])
+
+resumed_from = state['next']
+if resumed_from > 0:
+    print(f"Resuming at chunk {resumed_from} of {manifest['chunks']}")
+
+transferred = 0
+start = time.time()
+with open(args.out, 'r+b') as partition:
+    for index in range(resumed_from, manifest['chunks']):
+        if args.interrupt_after is not None and index - resumed_from >= args.interrupt_after:
+            print(f"Interrupted after chunk {index - 1}; run again to resume.")
+            sys.exit(1)
+
+        compressed = requests.get(f"{args.host}/firmware/chunk/{index}").content
+        chunk = zlib.decompress(compressed)
+        expected = min(manifest['chunkSize'], manifest['size'] - index * manifest['chunkSize'])
+        if len(chunk) != expected:
+            print(f"Chunk {index} decompressed to {len(chunk)} bytes, expected {expected}")
+            sys.exit(1)
+
+        partition.seek(index * manifest['chunkSize'])
+        partition.write(chunk)
+        transferred += len(compressed)
+
+        # Save progress after every chunk, like the device does in NVS
+        state['next'] = index + 1
+        with open(args.state, 'w') as file:
+            json.dump(state, file)
+elapsed_ms = int((time.time() - start) * 1000)
+
+# Verify hash over what was actually written
+with open(args.out, 'rb') as partition:
+    digest = hashlib.sha256(partition.read(manifest['size'])).hexdigest()
+if digest != manifest['sha256']:
+    print(f"Hash mismatch: got {digest}, expected {manifest['sha256']}")
+    os.remove(args.state)
+    sys.exit(1)
+os.remove(args.state)
+
+print(f"Verified v{manifest['version']}: transferred {transferred} of {manifest['size']} bytes "
+      f"({100 * transferred / manifest['size']:.1f}% of full image) in {elapsed_ms} ms")
+
+requests.post(f"{args.host}/firmware/report", json={
+    "version": manifest['version'],
+    "imageBytes": manifest['size'],
+    "transferredBytes": transferred,
+    "elapsedMs": elapsed_ms,
+    "resumedFrom": resumed_from,
+})
+
+if args.compare_full:
+    start = time.time()
+    full = requests.get(f"{args.host}/firmware/image").content
+    full_ms = int((time.time() - start) * 1000)
+    print(f"Full image: {len(full)} bytes in {full_ms} ms")
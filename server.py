@@ -20,10 +20,18 @@
 # 7. View Data Plot
 #    $ curl http://3.85.208.114:5000/graph
 
+# 8. Publish an OTA firmware update:
+#    $ pio run
+#    $ mkdir -p firmware && cp .pio/build/esp32dev/firmware.bin firmware/
+#    $ echo 2 > firmware/version.txt   (must match -D FIRMWARE_VERSION in platformio.ini)
+#    Devices poll /firmware/version and pull the image in compressed chunks.
+
 from flask import Flask, request, jsonify, send_file
 import matplotlib.pyplot as plt
 import os
 import csv
+import zlib
+import hashlib
 import requests
 from threading import Thread
 
@@ -38,6 +46,50 @@ if not os.path.exists(csv_file):
         writer = csv.writer(file)
         writer.writerow(['Play Time', 'Sleep Time'])  # Add header row
 
+# OTA firmware: the image that devices should be running and its version number
+firmware_dir = 'firmware'
+firmware_bin = os.path.join(firmware_dir, 'firmware.bin')
+firmware_version_file = os.path.join(firmware_dir, 'version.txt')
+# OTA transfer reports from devices
+ota_csv_file = 'ota.csv'
+# Uncompressed bytes per chunk (multiple of the 4 KB flash sector so each chunk erases cleanly)
+OTA_CHUNK_SIZE = 16384
+
+if not os.path.exists(ota_csv_file):
+    with open(ota_csv_file, 'w', newline='') as file:
+        writer = csv.writer(file)
+        writer.writerow(['Version', 'Image Bytes', 'Transferred Bytes', 'Elapsed ms', 'Resumed From Chunk'])
+
+# Compressed chunks are cached until firmware.bin or version.txt changes on disk
+firmware_cache = {'mtime': None}
+
+def load_firmware():
+    mtime = (os.path.getmtime(firmware_bin), os.path.getmtime(firmware_version_file))
+    if firmware_cache['mtime'] != mtime:
+        with open(firmware_bin, 'rb') as file:
+            image = file.read()
+        with open(firmware_version_file, 'r') as file:
+            version = int(file.read().strip())
+
+        # Each chunk is compressed on its own so a device can resume at any chunk boundary
+        chunks = [zlib.compress(image[i:i + OTA_CHUNK_SIZE], 9)
+                  for i in range(0, len(image), OTA_CHUNK_SIZE)]
+
+        firmware_cache.update({
+            'mtime': mtime,
+            'image': image,
+            'chunks': chunks,
+            'manifest': {
+                'version': version,
+                'size': len(image),
+                'sha256': hashlib.sha256(image).hexdigest(),
+                'chunkSize': OTA_CHUNK_SIZE,
+                'chunks': len(chunks),
+                'compressedSize': sum(len(chunk) for chunk in chunks),
+            },
+        })
+    return firmware_cache
+
 # Define the graphing function first
 def graph_times():
     play_times = []
@@ -107,6 +159,65 @@ def display_graph():
     except Exception as e:
         return f"Error generating graph: {str(e)}", 500
 
+# OTA Firmware Updates
+
+@app.route('/firmware/version')
+def firmware_version():
+    try:
+        return jsonify(load_firmware()['manifest']), 200
+    except FileNotFoundError:
+        return jsonify({"error": "No firmware published"}), 404
+
+@app.route('/firmware/chunk/<int:index>')
+def firmware_chunk(index):
+    try:
+        chunks = load_firmware()['chunks']
+    except FileNotFoundError:
+        return jsonify({"error": "No firmware published"}), 404
+    if index < 0 or index >= len(chunks):
+        return jsonify({"error": "Invalid chunk"}), 404
+    return chunks[index], 200, {'Content-Type': 'application/octet-stream'}
+
+# Uncompressed image, used as the baseline when comparing transfer size and time
+@app.route('/firmware/image')
+def firmware_image():
+    try:
+        image = load_firmware()['image']
+    except FileNotFoundError:
+        return jsonify({"error": "No firmware published"}), 404
+    return image, 200, {'Content-Type': 'application/octet-stream'}
+
+@app.route('/firmware/report', methods=['POST'])
+def firmware_report():
+    # JSON Data
+    data = request.get_json(silent=True)
+    if not isinstance(data, dict):
+        return jsonify({"error": "Invalid data"}), 400
+
+    version = data.get("version")
+    image_bytes = data.get("imageBytes")
+    transferred_bytes = data.get("transferredBytes")
+    elapsed_ms = data.get("elapsedMs")
+    resumed_from = data.get("resumedFrom", 0)
+
+    # Sizes must be positive ints, the rest non-negative ints (bool is an int in Python, so exclude it)
+    def is_int(value, minimum):
+        return isinstance(value, int) and not isinstance(value, bool) and value >= minimum
+
+    if not (is_int(version, 0) and is_int(image_bytes, 1) and is_int(transferred_bytes, 1)
+            and is_int(elapsed_ms, 0) and is_int(resumed_from, 0)):
+        return jsonify({"error": "Invalid data"}), 400
+
+    print(f"OTA v{version}: {transferred_bytes} of {image_bytes} bytes "
+          f"({100 * transferred_bytes / image_bytes:.1f}% of full image) in {elapsed_ms} ms")
+
+    # Append data to CSV file
+    with open(ota_csv_file, 'a', newline='') as file:
+        writer = csv.writer(file)
+        writer.writerow([version, image_bytes, transferred_bytes, elapsed_ms, resumed_from])
+
+    return jsonify({"message": "Report received successfully"}), 200
+
 # Main
 if __name__ == "__main__":
     # Start Flask server
@@ -36,6 +36,13 @@ State 3: Sleep State
     3. Re-enter play state upon detecting motion
     4. Track sleep time within sleep state -- are we sleeping? Add this sleep time to our stored sleep time variable
     5. Send sleep state analytics to the Cloud
+
+OTA Updates
+    1. On boot and periodically while asleep, check the server's firmware version
+    2. Download the newer image in compressed chunks straight into the inactive OTA partition
+    3. Save progress after every chunk so a dropped connection resumes where it left off
+    4. Verify the SHA-256 of the written image before switching boot partitions
+    5. If the new image can't finish setup and reach the update server within a few boots, roll back to the previous one
 */
 
 // ----------------------- BASIC LIBRARIES -----------------------------
@@ -52,6 +59,11 @@ State 3: Sleep State
 #include "freertos/task.h"
 #include "freertos/FreeRTOS.h"
 #include <WiFi.h>
+// ----------------------- OTA -----------------------------------------
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "mbedtls/sha256.h"
+#include "esp32/rom/miniz.h"
 
 // ----------------------- ACCELEROMETER -------------------------------
 #include "SparkFunLSM6DSO.h"
@@ -76,6 +88,26 @@ State 3: Sleep State
 char ssid[50];          // SSID
 char pass[50];          // Password
 
+// Server (override with build_flags to point at a local stand-in server)
+#ifndef SERVER_HOST
+#define SERVER_HOST "3.85.208.114"
+#endif
+#ifndef SERVER_PORT
+#define SERVER_PORT 5000
+#endif
+
+// OTA
+#ifndef FIRMWARE_VERSION
+#define FIRMWARE_VERSION 1
+#endif
+#define OTA_MAX_CHUNK_SIZE 32768            // Largest uncompressed chunk we will buffer
+#define OTA_CHUNK_RETRIES 3                 // Attempts per chunk before giving up until the next check
+#define OTA_MAX_BOOT_ATTEMPTS 3             // Boots a new image gets to reach ota_mark_valid() before rollback
+#define OTA_MAX_HASH_FAILURES 2             // Downloads of an image that fail the hash check before we stop trying it
+#define OTA_CHECK_INTERVAL 3600000          // Check for updates once an hour while asleep
+#define OTA_HTTP_TIMEOUT 10000              // Per-request timeout (in milliseconds)
+unsigned long lastOtaCheck = 0;
+
 // Motor PWM Configurations (speed control)
 int freq = 5000;        // PWM frequency
 int resolution = 8;     // 8-bit resolution (0-255 for duty cycle)
@@ -117,6 +149,10 @@ void stop_motors();
 void hunting_mode();
 void random_colors();
 void reset_AWS_data();
+bool ota_pending();
+void ota_mark_valid();
+bool ota_check_update();
+void ota_check_rollback();
 void run_motors(int speed);
 void send_time_AWS(unsigned long playTime, unsigned long sleepTime);
 void ramp_down_motor_speed(int initialSpeed, int targetSpeed, int rampTime);
@@ -127,6 +163,17 @@ void setup() {
     // ------------------- SERIAL COMMUNICATION ------------------------
     Serial.begin(9600);
     delay(500);
+
+    // ------------------- NON-VOLATILE STORAGE ------------------------
+    // Initialize NVS before anything reads from it
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(err);
+    // Roll back if a freshly updated image keeps failing to boot
+    ota_check_rollback();
     // Initial state
     Serial.println("Our initial state is PLAY!"); 
     // Initialize I2C  
@@ -140,10 +187,16 @@ void setup() {
     Serial.print("Connecting to ");
     Serial.println(ssid);
     WiFi.begin(ssid, pass);
+    unsigned long wifiStartTime = millis();
     // While wifi not connected...
     while (WiFi.status() != WL_CONNECTED) {
         delay(500);
         Serial.println(".");
+        // A new image that can't get online counts as a failed boot
+        if (ota_pending() && millis() - wifiStartTime > 30000) {
+            Serial.println("Update could not connect to WiFi, restarting...");
+            ESP.restart();
+        }
     }
     Serial.println("Connected to WiFi. Have fun!");
     Serial.println("IP address: ");
@@ -202,6 +255,16 @@ void setup() {
     ledcWrite(pwmChannelA, 0);
     ledcWrite(pwmChannelB, 0);
 
+    // ------------------- OTA UPDATE CHECK ----------------------------
+    // Motors and LEDs are in a safe state, pull a newer image if the server has one.
+    // A new image is only marked good once it reaches the update server (see ota_check_update()).
+    if (!ota_check_update() && ota_pending()) {
+        // A new image that can't reach the update server counts as a failed boot
+        Serial.println("Update could not reach the update server, restarting...");
+        ESP.restart();
+    }
+    lastOtaCheck = millis();
+
     // After device is turned on and initialized, we delay for 30 seconds to screw the ball back together and put it down for play
     delay(30000);
 }
@@ -319,6 +382,12 @@ void loop() {
             // Send play and sleep time to AWS
             send_time_AWS(playTime, sleepTime);
 
+            // The toy is idle, so this is a good time to check for updates
+            if (millis() - lastOtaCheck > OTA_CHECK_INTERVAL) {
+                ota_check_update();
+                lastOtaCheck = millis();
+            }
+
             // Calculate motion magnitude
             magnitude = sqrt(x_axis * x_axis + y_axis * y_axis);
 
@@ -594,19 +663,11 @@ void chirp() {
 // Non-volatile storage: Keeps data even if toy runs out of battery
 void nvs_access() {
 
-    // Initialize NVS
-    esp_err_t err = nvs_flash_init();
-    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        err = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(err);
-
-    // Open
+    // Open (NVS itself is initialized at the top of setup())
     Serial.printf("\n");
     Serial.printf("Opening Non-Volatile Storage (NVS) handle... ");
     nvs_handle_t my_handle;
-    err = nvs_open("storage", NVS_READWRITE, &my_handle);
+    esp_err_t err = nvs_open("storage", NVS_READWRITE, &my_handle);
 
     if (err != ESP_OK) {
         Serial.printf("Error (%s) opening NVS handle!\n", esp_err_to_name(err));
@@ -643,12 +704,12 @@ void send_time_AWS(unsigned long playTime, unsigned long sleepTime) {
 
     WiFiClient client; 
     // Send POST request
-    if (client.connect("3.85.208.114", 5000)) {
+    if (client.connect(SERVER_HOST, SERVER_PORT)) {
         String payload = "{\"test\": true, \"playTime\": " + String(playTime) + ", \"sleepTime\": " + String(sleepTime) + "}";
         //String payload = "{\"playTime\": " + String(playTime) + ", \"sleepTime\": " + String(sleepTime) + "}";
 
         client.println("POST /send-time HTTP/1.1");
-        client.println("Host: 3.85.208.114");
+        client.println("Host: " SERVER_HOST);
         client.println("Content-Type: application/json");
         client.print("Content-Length: ");
         client.println(payload.length());
@@ -672,4 +733,441 @@ void reset_AWS_data() {
     playStartTime = millis(); // Reset play timer
     sleepStartTime = millis(); // Reset sleep timer
     Serial.println("Play and sleep times reset for testing.");
+}
+
+// ----------------------- OTA Updates --------------------------
+
+// GET a path from the server into buf. Returns false on a non-200 response, timeout, or a body larger than cap.
+bool ota_http_get(const char* path, uint8_t* buf, size_t cap, size_t* len) {
+    WiFiClient client;
+    if (!client.connect(SERVER_HOST, SERVER_PORT)) {
+        Serial.println("Failed to connect to the server.");
+        return false;
+    }
+    client.setTimeout(OTA_HTTP_TIMEOUT / 1000);
+
+    client.print("GET ");
+    client.print(path);
+    client.println(" HTTP/1.1");
+    client.println("Host: " SERVER_HOST);
+    client.println("Connection: close");
+    client.println();
+
+    // Status line, e.g. "HTTP/1.1 200 OK"
+    String status = client.readStringUntil('\n');
+    if (status.indexOf(" 200 ") < 0) {
+        Serial.println("Request failed: " + status);
+        client.stop();
+        return false;
+    }
+
+    // Headers, we only need the body length
+    long contentLength = -1;
+    while (true) {
+        String header = client.readStringUntil('\n');
+        header.trim();
+        if (header.length() == 0) break;
+        header.toLowerCase();
+        if (header.startsWith("content-length:")) {
+            contentLength = header.substring(15).toInt();
+        }
+    }
+    if (contentLength < 0 || (size_t)contentLength > cap) {
+        Serial.printf("Bad content length: %ld\n", contentLength);
+        client.stop();
+        return false;
+    }
+
+    // Body
+    size_t received = 0;
+    unsigned long startTime = millis();
+    while (received < (size_t)contentLength && millis() - startTime < OTA_HTTP_TIMEOUT) {
+        if (client.available()) {
+            received += client.read(buf + received, contentLength - received);
+        } else if (!client.connected()) {
+            break;
+        } else {
+            delay(1);
+        }
+    }
+    client.stop();
+
+    *len = received;
+    return received == (size_t)contentLength;
+}
+
+// Pull the value for key out of a flat JSON object like {"version": 2, "sha256": "ab12..."}
+String ota_json_value(const String& json, const char* key) {
+    int keyStart = json.indexOf("\"" + String(key) + "\"");
+    if (keyStart < 0) return "";
+    int colon = json.indexOf(':', keyStart);
+    if (colon < 0) return "";
+    unsigned int start = colon + 1;
+    unsigned int end = start;
+    while (end < json.length() && json[end] != ',' && json[end] != '}') end++;
+    String value = json.substring(start, end);
+    value.trim();
+    value.replace("\"", "");
+    return value;
+}
+
+// Inflate one zlib-compressed chunk with the decompressor in ROM. Returns the number of bytes written to out.
+size_t ota_inflate(tinfl_decompressor* inflator, const uint8_t* in, size_t inLen, uint8_t* out, size_t outCap) {
+    tinfl_init(inflator);
+    size_t inSize = inLen;
+    size_t outSize = outCap;
+    tinfl_status result = tinfl_decompress(inflator, in, &inSize, out, out, &outSize,
+                                           TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    return result == TINFL_STATUS_DONE ? outSize : 0;
+}
+
+// SHA-256 of the first size bytes of a partition, as a lowercase hex string
+String ota_partition_sha256(const esp_partition_t* partition, size_t size) {
+    uint8_t buf[1024];
+    uint8_t digest[32];
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts_ret(&ctx, 0);
+    for (size_t offset = 0; offset < size; offset += sizeof(buf)) {
+        size_t n = min(sizeof(buf), size - offset);
+        if (esp_partition_read(partition, offset, buf, n) != ESP_OK) {
+            mbedtls_sha256_free(&ctx);
+            return "";
+        }
+        mbedtls_sha256_update_ret(&ctx, buf, n);
+    }
+    mbedtls_sha256_finish_ret(&ctx, digest);
+    mbedtls_sha256_free(&ctx);
+
+    char hex[65];
+    for (int i = 0; i < 32; i++) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+    return String(hex);
+}
+
+// Tell the server how much we actually transferred compared to the full image
+void ota_send_report(int version, size_t imageBytes, size_t transferredBytes, unsigned long elapsedMs, int resumedFrom) {
+    WiFiClient client;
+    if (client.connect(SERVER_HOST, SERVER_PORT)) {
+        String payload = "{\"version\": " + String(version) + ", \"imageBytes\": " + String(imageBytes) +
+                         ", \"transferredBytes\": " + String(transferredBytes) + ", \"elapsedMs\": " + String(elapsedMs) +
+                         ", \"resumedFrom\": " + String(resumedFrom) + "}";
+
+        client.println("POST /firmware/report HTTP/1.1");
+        client.println("Host: " SERVER_HOST);
+        client.println("Content-Type: application/json");
+        client.print("Content-Length: ");
+        client.println(payload.length());
+        client.println();
+        client.print(payload);
+
+        String response = client.readString();
+        Serial.println("Response: " + response);
+
+        client.stop();
+    } else {
+        Serial.println("Failed to connect to the server.");
+    }
+}
+
+// Count a downloaded image that failed verification, so ota_check_update() gives up on it after a few tries
+void ota_record_failure(nvs_handle_t otaHandle, const String& sha256) {
+    char failedSha[65] = "";
+    size_t failedShaLen = sizeof(failedSha);
+    uint8_t failures = 0;
+    nvs_get_str(otaHandle, "failed", failedSha, &failedShaLen);
+    if (sha256 == failedSha) {
+        nvs_get_u8(otaHandle, "failures", &failures);
+    }
+    nvs_set_str(otaHandle, "failed", sha256.c_str());
+    nvs_set_u8(otaHandle, "failures", failures + 1);
+    nvs_commit(otaHandle);
+}
+
+// Returns false only if /firmware/version could not be fetched, so a new image can prove it reaches the server
+bool ota_check_update() {
+    Serial.println("Checking for firmware update...");
+
+    // ------------------- VERSION CHECK -------------------------------
+    char manifestBuf[512];
+    size_t manifestLen = 0;
+    if (!ota_http_get("/firmware/version", (uint8_t*)manifestBuf, sizeof(manifestBuf) - 1, &manifestLen)) {
+        Serial.println("Could not fetch firmware version.");
+        return false;
+    }
+    manifestBuf[manifestLen] = '\0';
+    String manifest(manifestBuf);
+
+    int version = ota_json_value(manifest, "version").toInt();
+    size_t imageSize = ota_json_value(manifest, "size").toInt();
+    size_t chunkSize = ota_json_value(manifest, "chunkSize").toInt();
+    int chunks = ota_json_value(manifest, "chunks").toInt();
+    size_t compressedSize = ota_json_value(manifest, "compressedSize").toInt();
+    String sha256 = ota_json_value(manifest, "sha256");
+
+    // Reaching the update server is the last thing a new image has to prove before it counts as good
+    if (ota_pending()) {
+        ota_mark_valid();
+    }
+
+    Serial.printf("Running version %d, server version %d\n", FIRMWARE_VERSION, version);
+    if (version <= FIRMWARE_VERSION) {
+        return true;
+    }
+
+    // Chunks must line up with flash sectors so each one can be erased on its own
+    const esp_partition_t* target = esp_ota_get_next_update_partition(NULL);
+    if (target == NULL || imageSize == 0 || imageSize > target->size || chunkSize == 0 ||
+        chunkSize > OTA_MAX_CHUNK_SIZE || chunkSize % SPI_FLASH_SEC_SIZE != 0 || sha256.length() != 64 ||
+        chunks != (int)((imageSize + chunkSize - 1) / chunkSize)) {
+        Serial.println("Firmware update does not fit this device.");
+        return true;
+    }
+
+    // ------------------- RESUME ----------------------------------------
+    nvs_handle_t otaHandle;
+    if (nvs_open("ota", NVS_READWRITE, &otaHandle) != ESP_OK) {
+        Serial.println("Could not open OTA storage.");
+        return true;
+    }
+
+    // Skip the image we already installed, any image that was rolled back, and any image that keeps
+    // failing verification, otherwise a bad build (or one without a bumped FIRMWARE_VERSION) reinstalls on every check
+    char installedSha[65] = "";
+    char badSha[65] = "";
+    char failedSha[65] = "";
+    size_t installedShaLen = sizeof(installedSha);
+    size_t badShaLen = sizeof(badSha);
+    size_t failedShaLen = sizeof(failedSha);
+    uint8_t failures = 0;
+    nvs_get_str(otaHandle, "installed", installedSha, &installedShaLen);
+    nvs_get_str(otaHandle, "bad", badSha, &badShaLen);
+    nvs_get_str(otaHandle, "failed", failedSha, &failedShaLen);
+    nvs_get_u8(otaHandle, "failures", &failures);
+    if (sha256 == installedSha || sha256 == badSha) {
+        Serial.println("Server image was already installed or rolled back, skipping.");
+        nvs_close(otaHandle);
+        return true;
+    }
+    if (sha256 == failedSha && failures >= OTA_MAX_HASH_FAILURES) {
+        Serial.println("Server image keeps failing verification, skipping.");
+        nvs_close(otaHandle);
+        return true;
+    }
+
+    // Only resume if the saved progress is for this exact image and partition
+    char savedSha[65] = "";
+    char savedTarget[17] = "";
+    size_t savedShaLen = sizeof(savedSha);
+    size_t savedTargetLen = sizeof(savedTarget);
+    int32_t nextChunk = 0;
+    nvs_get_str(otaHandle, "sha", savedSha, &savedShaLen);
+    nvs_get_str(otaHandle, "target", savedTarget, &savedTargetLen);
+    if (sha256 == savedSha && strcmp(target->label, savedTarget) == 0) {
+        nvs_get_i32(otaHandle, "next", &nextChunk);
+    } else {
+        nvs_set_str(otaHandle, "sha", sha256.c_str());
+        nvs_set_str(otaHandle, "target", target->label);
+        nvs_set_i32(otaHandle, "next", 0);
+        nvs_commit(otaHandle);
+    }
+    int resumedFrom = nextChunk;
+    if (resumedFrom > 0) {
+        Serial.printf("Resuming update at chunk %d of %d\n", resumedFrom, chunks);
+    }
+
+    // ------------------- DOWNLOAD ------------------------------------
+    // zlib output can be slightly larger than its input for incompressible data
+    size_t compressedCap = chunkSize + chunkSize / 16 + 64;
+    uint8_t* compressed = (uint8_t*)malloc(compressedCap);
+    uint8_t* chunk = (uint8_t*)malloc(chunkSize);
+    tinfl_decompressor* inflator = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+    if (compressed == NULL || chunk == NULL || inflator == NULL) {
+        Serial.println("Not enough memory for update.");
+        free(compressed);
+        free(chunk);
+        free(inflator);
+        nvs_close(otaHandle);
+        return true;
+    }
+
+    size_t transferredBytes = 0;
+    unsigned long updateStartTime = millis();
+    for (int i = nextChunk; i < chunks; i++) {
+        size_t offset = (size_t)i * chunkSize;
+        size_t expected = min(chunkSize, imageSize - offset);
+        char path[40];
+        snprintf(path, sizeof(path), "/firmware/chunk/%d", i);
+
+        bool written = false;
+        for (int attempt = 0; attempt < OTA_CHUNK_RETRIES && !written; attempt++) {
+            size_t compressedLen = 0;
+            if (!ota_http_get(path, compressed, compressedCap, &compressedLen)) continue;
+            transferredBytes += compressedLen;
+            if (ota_inflate(inflator, compressed, compressedLen, chunk, chunkSize) != expected) {
+                Serial.printf("Chunk %d is corrupt\n", i);
+                continue;
+            }
+            // Erase whole sectors; the last chunk may be shorter than a sector
+            size_t eraseSize = (expected + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+            written = esp_partition_erase_range(target, offset, eraseSize) == ESP_OK &&
+                      esp_partition_write(target, offset, chunk, expected) == ESP_OK;
+        }
+        if (!written) {
+            // Keep our progress, the next check picks up from this chunk
+            Serial.printf("Update stopped at chunk %d of %d\n", i, chunks);
+            free(compressed);
+            free(chunk);
+            free(inflator);
+            nvs_close(otaHandle);
+            return true;
+        }
+
+        // Save progress
+        nvs_set_i32(otaHandle, "next", i + 1);
+        nvs_commit(otaHandle);
+        Serial.printf("Chunk %d of %d\n", i + 1, chunks);
+    }
+    unsigned long elapsedMs = millis() - updateStartTime;
+    free(compressed);
+    free(chunk);
+    free(inflator);
+
+    // Progress is no longer needed whether or not the image checks out
+    nvs_erase_key(otaHandle, "sha");
+    nvs_erase_key(otaHandle, "target");
+    nvs_erase_key(otaHandle, "next");
+    nvs_commit(otaHandle);
+
+    // ------------------- VERIFY --------------------------------------
+    // Hash what is actually in flash, including chunks written before a resume
+    if (ota_partition_sha256(target, imageSize) != sha256) {
+        Serial.println("Firmware hash mismatch, discarding update.");
+        ota_record_failure(otaHandle, sha256);
+        nvs_close(otaHandle);
+        return true;
+    }
+
+    // Compressed chunks vs the full image
+    Serial.printf("Transferred %u of %u bytes (%.1f%% of full image) in %lu ms\n",
+                  transferredBytes, imageSize, 100.0 * transferredBytes / imageSize, elapsedMs);
+    // Not measured: scales our time by byte count and leaves out per-chunk connection overhead.
+    // Use ota_client.py --compare-full for a measured full-image download.
+    if (resumedFrom == 0 && transferredBytes > 0) {
+        Serial.printf("Estimated full image time: ~%lu ms (server total: %u compressed bytes)\n",
+                      (unsigned long)((uint64_t)elapsedMs * imageSize / transferredBytes), compressedSize);
+    }
+    ota_send_report(version, imageSize, transferredBytes, elapsedMs, resumedFrom);
+
+    // ------------------- SWITCH --------------------------------------
+    // esp_ota_set_boot_partition also checks the image is a valid app
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    if (esp_ota_set_boot_partition(target) != ESP_OK) {
+        Serial.println("Firmware image is not bootable, discarding update.");
+        ota_record_failure(otaHandle, sha256);
+        nvs_close(otaHandle);
+        return true;
+    }
+
+    // Remember where to go back to if the new image does not boot
+    nvs_set_u8(otaHandle, "pending", 1);
+    nvs_set_u8(otaHandle, "boots", 0);
+    nvs_set_str(otaHandle, "prev", running->label);
+    nvs_set_str(otaHandle, "installed", sha256.c_str());
+    nvs_erase_key(otaHandle, "failed");
+    nvs_erase_key(otaHandle, "failures");
+    nvs_commit(otaHandle);
+    nvs_close(otaHandle);
+
+    Serial.printf("Updated to version %d, restarting...\n", version);
+    ESP.restart();
+    return true;
+}
+
+// Remember the installed image as bad so ota_check_update() won't download it again
+void ota_reject_installed(nvs_handle_t otaHandle) {
+    char installedSha[65] = "";
+    size_t installedShaLen = sizeof(installedSha);
+    if (nvs_get_str(otaHandle, "installed", installedSha, &installedShaLen) == ESP_OK) {
+        nvs_set_str(otaHandle, "bad", installedSha);
+        nvs_erase_key(otaHandle, "installed");
+    }
+}
+
+// True while a freshly installed image has not yet made it through setup
+bool ota_pending() {
+    nvs_handle_t otaHandle;
+    uint8_t pending = 0;
+    if (nvs_open("ota", NVS_READONLY, &otaHandle) == ESP_OK) {
+        nvs_get_u8(otaHandle, "pending", &pending);
+        nvs_close(otaHandle);
+    }
+    return pending == 1;
+}
+
+void ota_check_rollback() {
+    nvs_handle_t otaHandle;
+    if (nvs_open("ota", NVS_READWRITE, &otaHandle) != ESP_OK) {
+        return;
+    }
+
+    uint8_t pending = 0;
+    nvs_get_u8(otaHandle, "pending", &pending);
+    if (pending != 1) {
+        nvs_close(otaHandle);
+        return;
+    }
+
+    char prevLabel[17] = "";
+    size_t prevLabelLen = sizeof(prevLabel);
+    nvs_get_str(otaHandle, "prev", prevLabel, &prevLabelLen);
+    const esp_partition_t* running = esp_ota_get_running_partition();
+
+    // The bootloader already fell back to the old image, nothing to roll back
+    if (strcmp(running->label, prevLabel) == 0) {
+        ota_reject_installed(otaHandle);
+        nvs_erase_key(otaHandle, "pending");
+        nvs_commit(otaHandle);
+        nvs_close(otaHandle);
+        return;
+    }
+
+    // Count this boot of the new image
+    uint8_t boots = 0;
+    nvs_get_u8(otaHandle, "boots", &boots);
+    boots++;
+    Serial.printf("New firmware boot attempt %d of %d\n", boots, OTA_MAX_BOOT_ATTEMPTS);
+
+    if (boots > OTA_MAX_BOOT_ATTEMPTS) {
+        const esp_partition_t* prev = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, prevLabel);
+        if (prev != NULL && esp_ota_set_boot_partition(prev) == ESP_OK) {
+            Serial.println("New firmware failed to boot, rolling back...");
+            ota_reject_installed(otaHandle);
+            nvs_erase_key(otaHandle, "pending");
+            nvs_commit(otaHandle);
+            nvs_close(otaHandle);
+            ESP.restart();
+        }
+        // Nothing to go back to, keep running this image
+        Serial.println("Rollback failed, keeping new firmware.");
+        nvs_erase_key(otaHandle, "pending");
+    } else {
+        nvs_set_u8(otaHandle, "boots", boots);
+    }
+    nvs_commit(otaHandle);
+    nvs_close(otaHandle);
+}
+
+void ota_mark_valid() {
+    nvs_handle_t otaHandle;
+    if (nvs_open("ota", NVS_READWRITE, &otaHandle) == ESP_OK) {
+        nvs_erase_key(otaHandle, "pending");
+        nvs_erase_key(otaHandle, "boots");
+        nvs_erase_key(otaHandle, "prev");
+        nvs_commit(otaHandle);
+        nvs_close(otaHandle);
+    }
+    // Also cancel the bootloader's own rollback if it was built with rollback support
+    esp_ota_mark_app_valid_cancel_rollback();
 }
\ No newline at end of file